@@ -8,18 +8,598 @@
 #include <stdlib.h>
 #include <iostream>
 #include <cstring>
+#include <cmath>
 #include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 using namespace std;
 
 // global variables, duplicated in the child process
-FILE *rFile, *wFile;
-char xBuff[256] = {0};
+FILE *rFile, *wFile, *captureFile;
+char xBuff[256] = {0}, rBuff[256] = {0};
 pid_t pid;
 int firstPipe[2], secondPipe[2];
 
+// command line options
+bool useDict = false;
+int window = 2, budget = 16, pinCpu = -1, childCpu = -1;
+long sampleCount = 0, testCount = 0, spinBudget = 0, typeBench = 0, traceEvery = 0;
+const char *replayDir = 0, *servePath = 0, *attachPath = 0;
+const char *traceOut = "pipey_trace.json";
+int replayJobs = 0, serveWorkers = 4;
+bool useHuge = false, benchMode = false;
+bool packMode = false, packHex = false, toJson = false;
+
+// prompts and notices, moved off stdout when output is packed
+ostream *textOut = &cout;
+
+// --------------------------------------------------------------
+// per-channel dictionary of repeated string tails, one for each
+// direction of each connection.  The sender assigns ids in order
+// of first occurrence, so the receiver assigns the same ids by
+// replaying the defines it sees, and no ids ever cross the wire
+// except in packet tails.
+class whatDict
+{
+public:
+    whatDict() {clear();}
+
+    // instance methods
+    void clear();
+    int find(const char *str, int size);
+    int insert(const char *str, int size);
+    const char *lookup(int id, int &size);
+    int entries() {return count;}
+
+private:
+    enum {maxEntries = 256, tableSize = 512, arenaSize = 16384};
+    unsigned hash(const char *str, int size);
+
+    short table[tableSize];     // open addressing, entry id + 1
+    int offset[maxEntries];     // start of each string in arena
+    short length[maxEntries];   // size of each string in arena
+    int count, used;            // entries and arena bytes in use
+    char arena[arenaSize];      // string bytes, no trailing nulls
+};
+
+// forget all entries, used at start of each connection
+void whatDict::clear()
+{
+    memset(table, 0, sizeof(table));
+    count = used = 0;
+}
+
+// FNV-1a hash of string bytes
+unsigned whatDict::hash(const char *str, int size)
+{
+    unsigned h = 2166136261u;
+    for (int n = 0; n < size; n++) {h = (h ^ (unsigned char)str[n]) * 16777619u;}
+    return h;
+}
+
+// return id of string, or -1 if not present
+int whatDict::find(const char *str, int size)
+{
+    for (unsigned h = hash(str, size);; h++)
+    {
+        int id = table[h % tableSize] - 1;
+        if (id < 0) {return -1;}
+        if (length[id] == size && !memcmp(arena + offset[id], str, size)) {return id;}
+    }
+}
+
+// add string, return new id or -1 if dictionary is full
+int whatDict::insert(const char *str, int size)
+{
+    if (count >= maxEntries || used + size > arenaSize) {return -1;}
+    unsigned h = hash(str, size);
+    while (table[h % tableSize]) {h++;}
+    table[h % tableSize] = count + 1;
+    offset[count] = used;
+    length[count] = size;
+    memcpy(arena + used, str, size);
+    used += size;
+    return count++;
+}
+
+// return string for id, or null if id is unknown
+const char *whatDict::lookup(int id, int &size)
+{
+    if (id < 0 || id >= count) {return 0;}
+    size = length[id];
+    return arena + offset[id];
+}
+
+// dictionaries for inbound and outbound channels
+whatDict rDict, wDict;
+
+// write id as little-endian base 128 varint, return byte count
+int putVarint(unsigned char *p, int id)
+{
+    int n = 0;
+    while (id >= 0x80) {p[n++] = (id & 0x7f) | 0x80; id >>= 7;}
+    p[n++] = id;
+    return n;
+}
+
+// read varint id from at most size bytes, return byte count or 0
+int getVarint(const unsigned char *p, int size, int &id)
+{
+    id = 0;
+    for (int n = 0; n < size && n < 4; n++)
+    {
+        id |= (p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {return n + 1;}
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------
+// compact output, a subset of MessagePack written straight from
+// the packed struct fields, multi-byte values are big-endian
+
+// write n low bytes of value, most significant first
+void packBE(ostream &os, unsigned long value, int n)
+{
+    while (n--) {os.put(char(value >> (8 * n)));}
+}
+
+void packMap(ostream &os, int n)
+{
+    os.put(char(0x80 | n));     // fixmap, at most 15 pairs
+}
+
+void packInt(ostream &os, long value)
+{
+    if (value >= -32 && value < 128) {os.put(char(value));}
+    else if (value == int(value)) {os.put(char(0xd2)); packBE(os, value, 4);}
+    else {os.put(char(0xd3)); packBE(os, value, 8);}
+}
+
+void packFloat(ostream &os, float value)
+{
+    unsigned bits;
+    memcpy(&bits, &value, 4);
+    os.put(char(0xca));
+    packBE(os, bits, 4);
+}
+
+void packDouble(ostream &os, double value)
+{
+    unsigned long bits;
+    memcpy(&bits, &value, 8);
+    os.put(char(0xcb));
+    packBE(os, bits, 8);
+}
+
+void packStr(ostream &os, const char *str, int n)
+{
+    if (n < 32) {os.put(char(0xa0 | n));}
+    else if (n < 256) {os.put(char(0xd9)); packBE(os, n, 1);}
+    else {os.put(char(0xda)); packBE(os, n, 2);}
+    os.write(str, n);
+}
+
+void packStr(ostream &os, const char *str)
+{
+    packStr(os, str, strlen(str));
+}
+
+void packBin(ostream &os, const unsigned char *bin, int n)
+{
+    if (n < 256) {os.put(char(0xc4)); packBE(os, n, 1);}
+    else {os.put(char(0xc5)); packBE(os, n, 2);}
+    os.write(reinterpret_cast<const char *>(bin), n);
+}
+
+// the same encodings into memory, each returns the end of what it
+// wrote, so a whole packet can go to the stream in one write
+unsigned char *packBE(unsigned char *at, unsigned long value, int n)
+{
+    while (n--) {*at++ = value >> (8 * n);}
+    return at;
+}
+
+unsigned char *packInt(unsigned char *at, long value)
+{
+    if (value >= -32 && value < 128) {*at++ = value; return at;}
+    if (value == int(value)) {*at++ = 0xd2; return packBE(at, value, 4);}
+    *at++ = 0xd3;
+    return packBE(at, value, 8);
+}
+
+unsigned char *packStr(unsigned char *at, const char *str, int n)
+{
+    if (n < 32) {*at++ = 0xa0 | n;}
+    else if (n < 256) {*at++ = 0xd9; *at++ = n;}
+    else {*at++ = 0xda; at = packBE(at, n, 2);}
+    memcpy(at, str, n);
+    return at + n;
+}
+
+unsigned char *packBin(unsigned char *at, const unsigned char *bin, int n)
+{
+    if (n < 256) {*at++ = 0xc4; *at++ = n;}
+    else {*at++ = 0xc5; at = packBE(at, n, 2);}
+    memcpy(at, bin, n);
+    return at + n;
+}
+
+// one decoded value, kind is i(nt), f(loat), s(tring), b(in), m(ap).
+// A number is in i or f, as kind says, and a float32 also keeps its
+// exact bits, NaN payload included, when exact32 is set
+struct packValue
+{
+    char kind;
+    long i;
+    double f;
+    bool exact32;
+    unsigned bits;
+    string s;
+};
+
+// a number as either type, whichever kind it was decoded as
+long intOf(const packValue &v)
+{
+    if (v.kind != 'f') {return v.i;}
+    return (fabs(v.f) < 9.2e18)? long(v.f): 0;
+}
+
+double realOf(const packValue &v)
+{
+    return (v.kind == 'f')? v.f: v.i;
+}
+
+// read n bytes as unsigned big-endian, false at end of input
+bool unpackBE(istream &is, int n, unsigned long &value)
+{
+    value = 0;
+    while (n--)
+    {
+        int c = is.get();
+        if (c == EOF) {return false;}
+        value = (value << 8) | c;
+    }
+    return true;
+}
+
+// read one value, return false on end of input or unknown format
+bool unpackValue(istream &is, packValue &v)
+{
+    unsigned long u;
+    int c = is.get();
+    if (c == EOF) {return false;}
+    v.kind = 'i';
+    v.i = 0;
+    v.f = 0;
+    v.exact32 = false;
+    if (c < 0x80) {v.i = c; return true;}
+    if (c >= 0xe0) {v.i = c - 0x100; return true;}
+    if ((c & 0xf0) == 0x80) {v.kind = 'm'; v.i = c & 0x0f; return true;}
+    int n = 0;
+    if ((c & 0xe0) == 0xa0) {v.kind = 's'; n = c & 0x1f;}
+    else switch (c)
+    {
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+            if (!unpackBE(is, 1 << (c - 0xcc), u)) {return false;}
+            v.i = u;
+            return true;
+
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+            // sign extend from the width read
+            n = 1 << (c - 0xd0);
+            if (!unpackBE(is, n, u)) {return false;}
+            v.i = (n == 8)? long(u): long(u << (64 - 8 * n)) >> (64 - 8 * n);
+            return true;
+
+        case 0xca:
+        {
+            if (!unpackBE(is, 4, u)) {return false;}
+            unsigned bits = u;
+            float value;
+            memcpy(&value, &bits, 4);
+            v.kind = 'f';
+            v.f = value;
+            v.exact32 = true;
+            v.bits = bits;
+            return true;
+        }
+
+        case 0xcb:
+            if (!unpackBE(is, 8, u)) {return false;}
+            memcpy(&v.f, &u, 8);
+            v.kind = 'f';
+            return true;
+
+        case 0xd9: case 0xda: case 0xc4: case 0xc5:
+            v.kind = (c < 0xd0)? 'b': 's';
+            if (!unpackBE(is, (c == 0xda || c == 0xc5)? 2: 1, u)) {return false;}
+            n = u;
+            break;
+
+        case 0xde:
+            if (!unpackBE(is, 2, u)) {return false;}
+            v.kind = 'm';
+            v.i = u;
+            return true;
+
+        default:
+            return false;
+    }
+    v.s.resize(n);
+    return n == 0 || is.read(&v.s[0], n);
+}
+
+// --------------------------------------------------------------
+// registry of packet types, a dense table indexed by type id.
+// Each entry lists the fixed members with precomputed offsets and
+// a field kind, and points at the code that reports and modifies
+// the type: hand-written for whatA and whatB, or the generic field
+// walkers for types loaded from a schema file at startup.
+
+class whatBase;
+
+// one kind of fixed member, with its formatters
+struct whatKind
+{
+    const char *name;
+    int size;
+    void (*show)(ostream &os, const unsigned char *p);
+    unsigned char *(*pack)(unsigned char *at, const unsigned char *p);
+    void (*scale)(unsigned char *p, double by);
+    void (*put)(unsigned char *p, const packValue &v);    // any number
+};
+
+// one fixed member of a packet type
+struct whatField
+{
+    char name[24];
+    short offset;           // from start of packet
+    short kind;             // index into fieldKinds
+    double scale;           // multiplier applied by modify()
+    unsigned char key[25];  // name as packed, set by addType()
+    short keySize;
+};
+
+// one packet type, head is zero if the id is not registered
+struct whatType
+{
+    char name[24];
+    int head;               // size of fixed members, with base
+    int fields;
+    whatField field[8];
+    char marker[8];         // appended by modify(), no null
+    int markerSize;
+    void (*serialize)(whatBase *what, ostream &os);
+    void (*modify)(whatBase *what);
+};
+whatType typeTable[256];
+
+// formatters for integer kinds, integer scaling wraps
+template <class T> void showInt(ostream &os, const unsigned char *p)
+{
+    T v;
+    memcpy(&v, p, sizeof(v));
+    os << long(v);
+}
+
+template <class T> unsigned char *packIntKind(unsigned char *at, const unsigned char *p)
+{
+    T v;
+    memcpy(&v, p, sizeof(v));
+    return packInt(at, v);
+}
+
+template <class T> void scaleInt(unsigned char *p, double by)
+{
+    T v;
+    memcpy(&v, p, sizeof(v));
+    v = T((unsigned long)v * (unsigned long)long(by));
+    memcpy(p, &v, sizeof(v));
+}
+
+template <class T> void putInt(unsigned char *p, const packValue &v)
+{
+    T value = T(intOf(v));
+    memcpy(p, &value, sizeof(value));
+}
+
+// formatters for real kinds, float keeps NaN payload from exact bits
+template <class T> void showReal(ostream &os, const unsigned char *p)
+{
+    T v;
+    memcpy(&v, p, sizeof(v));
+    os << v;
+}
+
+unsigned char *packF32(unsigned char *at, const unsigned char *p)
+{
+    unsigned bits;
+    memcpy(&bits, p, 4);
+    *at++ = 0xca;
+    return packBE(at, bits, 4);
+}
+
+unsigned char *packF64(unsigned char *at, const unsigned char *p)
+{
+    unsigned long bits;
+    memcpy(&bits, p, 8);
+    *at++ = 0xcb;
+    return packBE(at, bits, 8);
+}
+
+template <class T> void scaleReal(unsigned char *p, double by)
+{
+    T v;
+    memcpy(&v, p, sizeof(v));
+    v *= by;
+    memcpy(p, &v, sizeof(v));
+}
+
+void putF32(unsigned char *p, const packValue &v)
+{
+    if (v.kind == 'f' && v.exact32) {memcpy(p, &v.bits, 4); return;}
+    float value = realOf(v);
+    memcpy(p, &value, 4);
+}
+
+void putF64(unsigned char *p, const packValue &v)
+{
+    double value = realOf(v);
+    memcpy(p, &value, 8);
+}
+
+const whatKind fieldKinds[] =
+{
+    {"i8", 1, showInt<signed char>, packIntKind<signed char>, scaleInt<signed char>, putInt<signed char>},
+    {"i16", 2, showInt<short>, packIntKind<short>, scaleInt<short>, putInt<short>},
+    {"i32", 4, showInt<int>, packIntKind<int>, scaleInt<int>, putInt<int>},
+    {"i64", 8, showInt<long>, packIntKind<long>, scaleInt<long>, putInt<long>},
+    {"f32", 4, showReal<float>, packF32, scaleReal<float>, putF32},
+    {"f64", 8, showReal<double>, packF64, scaleReal<double>, putF64}
+};
+enum {kindI8, kindI16, kindI32, kindI64, kindF32, kindF64, kindCount};
+
+// ids of types loaded from a schema, which the parent also sends
+vector<int> schemaTypes;
+
+// enter a type in the table, with its field names packed ahead
+void addType(int id, whatType &entry)
+{
+    for (int n = 0; n < entry.fields; n++)
+    {
+        whatField &f = entry.field[n];
+        f.keySize = packStr(f.key, f.name, strlen(f.name)) - f.key;
+    }
+    typeTable[id] = entry;
+}
+
+// --------------------------------------------------------------
+// per-packet tracing of the round trip.  A sampled packet carries
+// a trace record as a header extension after its tail on the wire,
+// flagged in the type, and each stage stamps the record as the
+// packet passes.  Stamps are offsets from the first one, to keep
+// the extension small.  Completed records go into a trace ring.
+
+// stages a packet is stamped at, spans run between them
+enum traceStage
+{
+    stampPopulate,      // parent starts populate()
+    stampQueued,        // populate() returns, packet waits for room and credit
+    stampSend,          // packet leaves the queue for writeOut()
+    stampWritten,       // writeOut() returns, parent side only
+    stampChildRead,     // child readIn() returns
+    stampModified,      // child modify() returns, reply goes out
+    stampReplyRead,     // parent readIn() returns
+    stampSerialized,    // parent serialize() returns
+    stampCount
+};
+
+struct whatTrace
+{
+    long start;                     // CLOCK_MONOTONIC_RAW in ns
+    int seq;                        // zero if not sampled
+    int pid;                        // child process, set by child
+    unsigned delta[stampCount - 1]; // ns after start, by stamp
+};
+
+// stamp a record at one stage, stamps past 4 seconds are clamped
+void traceStamp(whatTrace &trace, enum traceStage stamp, long now)
+{
+    if (stamp == stampPopulate) {trace.start = now; return;}
+    long delta = now - trace.start;
+    trace.delta[stamp - 1] = (delta < 0)? 0: (delta > 0xffffffffL)? 0xffffffffu: delta;
+}
+
+// fixed-size ring of completed records for one process.  One thread
+// writes and publishes each record with a release store, so a reader
+// never waits for it, and the oldest records are overwritten.
+class traceRing
+{
+public:
+    traceRing(): head(0) {}
+    void push(const whatTrace &trace);
+    void exportJson(ostream &os, pid_t parent);
+
+private:
+    enum {ringSize = 4096};
+    whatTrace records[ringSize];
+    atomic<unsigned long> head;
+};
+
+// add a record, then publish it
+void traceRing::push(const whatTrace &trace)
+{
+    unsigned long at = head.load(memory_order_relaxed);
+    records[at % ringSize] = trace;
+    head.store(at + 1, memory_order_release);
+}
+
+// write held records as Chrome trace events, readable by Perfetto,
+// child spans under the child pid, pipe transit under its own tid.
+// The child may read a packet before writeOut() returns, so transit
+// to the child is timed from the send stamp.
+void traceRing::exportJson(ostream &os, pid_t parent)
+{
+    static const struct {const char *name; int from, to, tid;} spans[] =
+    {
+        {"populate", stampPopulate, stampQueued, 1},
+        {"queue", stampQueued, stampSend, 1},
+        {"writeOut", stampSend, stampWritten, 1},
+        {"toChild", stampSend, stampChildRead, 2},
+        {"modify", stampChildRead, stampModified, 0},
+        {"toParent", stampModified, stampReplyRead, 2},
+        {"serialize", stampReplyRead, stampSerialized, 1}
+    };
+    unsigned long end = head.load(memory_order_acquire);
+    unsigned long begin = (end > ringSize)? end - ringSize: 0;
+    long base = (begin < end)? records[begin % ringSize].start: 0;
+    os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" << fixed << setprecision(3);
+    for (unsigned long n = begin; n < end; n++)
+    {
+        const whatTrace &t = records[n % ringSize];
+        for (int span = 0; span < 7; span++)
+        {
+            long from = spans[span].from? t.delta[spans[span].from - 1]: 0;
+            long to = t.delta[spans[span].to - 1];
+            os << ((n > begin || span)? ",\n": "\n")
+                << "{\"name\":\"" << spans[span].name << "\",\"ph\":\"X\""
+                << ",\"pid\":" << (spans[span].tid? parent: t.pid)
+                << ",\"tid\":" << max(spans[span].tid, 1)
+                << ",\"ts\":" << (t.start - base + from) * 1e-3
+                << ",\"dur\":" << (to - from) * 1e-3
+                << ",\"args\":{\"seq\":" << t.seq << "}}";
+        }
+    }
+    os << "\n]}" << endl;
+    os.unsetf(ios::floatfield);
+}
+
 // suppress padding in the following classes
-#pragma pack(2)
+#pragma pack(push, 2)
 
 // WARNING These classes use zero-length arrays,
 // so they must never be instantiated!  The intended
@@ -37,13 +617,30 @@ public:
     {
         typeNone,
         typeA = 10,
-        typeB
+        typeB,
+
+        // flags set on the wire only, never in memory
+        flagDefine = 0x100, // tail is varint id then string
+        flagRef = 0x200,    // tail is varint id only
+        flagTrace = 0x400   // trace record follows the tail
     };
 
     // instance methods
     void showHex(ostream &os);
-    void writeOut(FILE *file);
-    enum typeEnum readIn(FILE *file);
+    void serialize(ostream &os);
+    void modify();
+    void writeOut(FILE *file, class whatDict *dict = 0, whatTrace *trace = 0);
+    enum typeEnum readIn(FILE *file, class whatDict *dict = 0, whatTrace *trace = 0);
+    int headSize();
+    int getLength() {return length;}
+    enum typeEnum getType() {return type;}
+    static bool knownType(const void *packet);
+
+    // generic methods for registered types, through typeTable
+    bool populate(int id, long value, const string &c);
+    bool rebuild(int id, const vector<pair<string, packValue> > &values);
+    static void serializeFields(whatBase *what, ostream &os);
+    static void modifyFields(whatBase *what);
 
 protected:
     // member list for memory layout (8 bytes total)
@@ -70,18 +667,140 @@ void whatBase::showHex(ostream &os)
     os << "\n]" << dec << setfill(' ') << flush;
 }
 
+// true if a packet in memory, not yet trusted, has a registered
+// type without wire flags, checked before it is loaded as an enum
+bool whatBase::knownType(const void *packet)
+{
+    int rawType;
+    memcpy(&rawType, static_cast<const char *>(packet) + 4, 4);
+    return rawType >= 0 && rawType <= 0xff && typeTable[rawType].head;
+}
+
 // read a packet from anonymous pipe, return type enum
-enum whatBase::typeEnum whatBase::readIn(FILE *file)
+// a dictionary-coded tail is expanded in place, so the
+// packet in memory always holds the full string, and a
+// trace record is moved out to trace, if one is given
+enum whatBase::typeEnum whatBase::readIn(FILE *file, whatDict *dict, whatTrace *trace)
 {
-    if (!fread(buffer, 1, 4, file)) {return typeNone;}
-    if (!fread(buffer + 4, 1, length - 4, file)) {return typeNone;}
+    if (trace) {trace->seq = 0;}
+    if (fread(buffer, 1, 4, file) != 4) {return typeNone;}
+    if (length < 8 || length > 256)
+    {
+        cerr << "Bad length: " << length << ", pid: " << pid << endl;
+        return typeNone;
+    }
+    if (fread(buffer + 4, 1, length - 4, file) != size_t(length - 4)) {return typeNone;}
+
+    // check raw value before it is loaded as an enum
+    int rawType;
+    memcpy(&rawType, buffer + 4, 4);
+    if (rawType & ~(flagDefine | flagRef | flagTrace | 0xff)
+        || (rawType & (flagDefine | flagRef)) == (flagDefine | flagRef))
+    {
+        cerr << "Bad type: " << rawType << ", pid: " << pid << endl;
+        return typeNone;
+    }
+
+    // trace record is last on the wire
+    if (type & flagTrace)
+    {
+        if (length < int(8 + sizeof(whatTrace)))
+        {
+            cerr << "Bad trace record, pid: " << pid << endl;
+            return typeNone;
+        }
+        length -= sizeof(whatTrace);
+        if (trace) {memcpy(trace, buffer + length, sizeof(whatTrace));}
+        type = typeEnum(type & ~flagTrace);
+    }
+    if (!(type & (flagDefine | flagRef))) {return type;}
+
+    // decode the id that replaces or precedes the string
+    enum typeEnum flags = typeEnum(type & (flagDefine | flagRef));
+    type = typeEnum(type & ~(flagDefine | flagRef));
+    int head = headSize(), id = 0;
+    int vSize = getVarint(buffer + head, length - head, id);
+    if (!dict || !vSize)
+    {
+        cerr << "Bad dictionary tail, pid: " << pid << endl;
+        return typeNone;
+    }
+
+    // first occurrence, remember string and close the gap
+    int cSize = length - head - vSize;
+    if (flags == flagDefine)
+    {
+        if (dict->insert(reinterpret_cast<char *>(buffer) + head + vSize, cSize) != id)
+        {
+            cerr << "Dictionary out of step, pid: " << pid << endl;
+            return typeNone;
+        }
+        memmove(buffer + head, buffer + head + vSize, cSize);
+        length = head + cSize;
+        return type;
+    }
+
+    // repeated string, copy it back from the dictionary
+    const char *str = dict->lookup(id, cSize);
+    if (!str || head + cSize > 256)
+    {
+        cerr << "Unknown dictionary id: " << id << ", pid: " << pid << endl;
+        return typeNone;
+    }
+    memcpy(buffer + head, str, cSize);
+    length = head + cSize;
     return type;
 }
 
-// write a packet to anonymous pipe
-void whatBase::writeOut(FILE *file)
+// write a packet to anonymous pipe, replacing the string tail
+// with a dictionary id when one is given, and adding the trace
+// record when one is given and fits, packet is unchanged
+void whatBase::writeOut(FILE *file, whatDict *dict, whatTrace *trace)
 {
-    fwrite(buffer, 1, length, file);
+    int head = headSize(), cSize = length - head;
+    unsigned char wire[256];
+    int wSize = length, flag = 0;
+
+    // look up string, define it on first occurrence if the
+    // define fits, ids below 256 need at most two varint bytes
+    if (dict && cSize >= 2)
+    {
+        const char *str = reinterpret_cast<char *>(buffer) + head;
+        int id = dict->find(str, cSize);
+        flag = flagRef;
+        if (id < 0 && head + 2 + cSize <= 256) {id = dict->insert(str, cSize); flag = flagDefine;}
+
+        // build wire packet in place of the string tail
+        if (id < 0) {flag = 0;}
+        else
+        {
+            int vSize = putVarint(wire + head, id);
+            wSize = head + vSize + ((flag == flagDefine)? cSize: 0);
+            memcpy(wire, buffer, head);
+            if (flag == flagDefine) {memcpy(wire + head + vSize, str, cSize);}
+        }
+    }
+
+    // trace record goes last, untraced if it will not fit
+    if (trace && wSize + sizeof(whatTrace) <= 256)
+    {
+        if (!flag) {memcpy(wire, buffer, length);}
+        memcpy(wire + wSize, trace, sizeof(whatTrace));
+        wSize += sizeof(whatTrace);
+        flag |= flagTrace;
+    }
+
+    // send the packet as it is, or the wire form
+    if (!flag)
+    {
+        fwrite(buffer, 1, length, file);
+        fflush(file);
+        return;
+    }
+    whatBase *wHead = reinterpret_cast<whatBase *>(wire);
+    wHead->length = wSize;
+    wHead->type = typeEnum(type | flag);
+    fwrite(wire, 1, wSize, file);
     fflush(file);
 }
 
@@ -91,9 +810,12 @@ class whatA: public whatBase
 {
 public:
     // instance methods
-    void populate(float a, double b, const string &c);
+    bool populate(float a, double b, const string &c);
     void serialize(ostream &os);
+    void pack(ostream &os);
     void modify(double d);
+    string getStr() {return string(theStr, length - sizeof(whatA));}
+    static void registerType();
 
 private:
     // member list for memory layout, without trailing null
@@ -102,15 +824,15 @@ private:
     char theStr[0]; // zero-length array (must be last)
 };
 
-// initialization method for type A
-void whatA::populate(float a, double b, const string &c)
+// initialization method for type A, return false if string is too long
+bool whatA::populate(float a, double b, const string &c)
 {
     // check for plausible input
     int cSize = c.size();
-    if (cSize < 0 || cSize > 250)
+    if (cSize < 0 || cSize > int(256 - sizeof(whatA)))
     {
-        cerr << "Bad string size: " << cSize << endl;
-        return;
+        cerr << "Bad string size: " << cSize << ", limit: " << 256 - sizeof(whatA) << endl;
+        return false;
     }
 
     // copy data members into memory, no trailing null
@@ -119,21 +841,22 @@ void whatA::populate(float a, double b, const string &c)
     theFlt = a;
     theDbl = b;
     c.copy(theStr, cSize);
+    return true;
 }
 
 // report method for type A
 void whatA::serialize(ostream &os)
 {
     // check for plausible input
-    if (length < 0 || length > 256)
+    if (length < int(sizeof(whatA)) || length > 256)
     {
-        os << "Bad length: " << length << ", pid: " << pid << endl;
+        (packMode? cerr: os) << "Bad length: " << length << ", pid: " << pid << endl;
         return;
     }
+    if (packMode) {pack(os); return;}
 
     // show struct data members first
-    int cSize = length - sizeof(whatA);
-    string cStr(theStr, cSize);
+    string cStr = getStr();
     os << dec << setprecision(8)
         << ",{\"length\":" << length
         << ",\"type\":" << type
@@ -146,11 +869,34 @@ void whatA::serialize(ostream &os)
     os << '}' << endl;
 }
 
+// compact report method for type A, the hex bytes are optional
+// since they can be rebuilt from the fields
+void whatA::pack(ostream &os)
+{
+    packMap(os, packHex? 6: 5);
+    packStr(os, "length");
+    packInt(os, length);
+    packStr(os, "type");
+    packInt(os, type);
+    packStr(os, "theFlt");
+    packFloat(os, theFlt);
+    packStr(os, "theDbl");
+    packDouble(os, theDbl);
+    packStr(os, "theStr");
+    packStr(os, theStr, length - sizeof(whatA));
+    if (packHex)
+    {
+        packStr(os, "hex");
+        packBin(os, buffer, length);
+    }
+}
+
 // modify values stored in data members, no trailing null
 void whatA::modify(double d)
 {
     theFlt *= d;
     theDbl *= (d*d);
+    if (length + 3 > 256) {return;}
     memcpy(buffer + length, ")>-", 3);
     length += 3;
 }
@@ -161,9 +907,12 @@ class whatB: public whatBase
 {
 public:
     // instance methods
-    void populate(short a, int b, const string &c);
+    bool populate(short a, int b, const string &c);
     void serialize(ostream &os);
+    void pack(ostream &os);
     void modify(int d);
+    string getStr() {return string(theStr, length - sizeof(whatB));}
+    static void registerType();
 
 private:
     // member list for memory layout, without trailing null
@@ -172,15 +921,18 @@ private:
     char theStr[0]; // zero-length array (must be last)
 };
 
-// initialization method for type B
-void whatB::populate(short a, int b, const string &c)
+// restore padding for everything after the packet classes
+#pragma pack(pop)
+
+// initialization method for type B, return false if string is too long
+bool whatB::populate(short a, int b, const string &c)
 {
     // check for plausible input
     int cSize = c.size();
-    if (cSize < 0 || cSize > 250)
+    if (cSize < 0 || cSize > int(256 - sizeof(whatB)))
     {
-        cerr << "Bad string size: " << cSize << endl;
-        return;
+        cerr << "Bad string size: " << cSize << ", limit: " << 256 - sizeof(whatB) << endl;
+        return false;
     }
 
     // copy data members into memory, no trailing null
@@ -189,21 +941,22 @@ void whatB::populate(short a, int b, const string &c)
     theShort = a;
     theInt = b;
     c.copy(theStr, cSize);
+    return true;
 }
 
 // report method for type B
 void whatB::serialize(ostream &os)
 {
     // check for plausible input
-    if (length < 0 || length > 256)
+    if (length < int(sizeof(whatB)) || length > 256)
     {
-        os << "Bad length: " << length << ", pid: " << pid << endl;
+        (packMode? cerr: os) << "Bad length: " << length << ", pid: " << pid << endl;
         return;
     }
+    if (packMode) {pack(os); return;}
 
     // show struct data members first
-    int cSize = length - sizeof(whatB);
-    string cStr(theStr, cSize);
+    string cStr = getStr();
     os << dec << setprecision(8)
         << ",{\"length\":" << length
         << ",\"type\":" << type
@@ -216,125 +969,1748 @@ void whatB::serialize(ostream &os)
     os << '}' << endl;
 }
 
+// compact report method for type B, the hex bytes are optional
+// since they can be rebuilt from the fields
+void whatB::pack(ostream &os)
+{
+    packMap(os, packHex? 6: 5);
+    packStr(os, "length");
+    packInt(os, length);
+    packStr(os, "type");
+    packInt(os, type);
+    packStr(os, "theShort");
+    packInt(os, theShort);
+    packStr(os, "theInt");
+    packInt(os, theInt);
+    packStr(os, "theStr");
+    packStr(os, theStr, length - sizeof(whatB));
+    if (packHex)
+    {
+        packStr(os, "hex");
+        packBin(os, buffer, length);
+    }
+}
+
 // modify values stored in data members, no trailing null
 void whatB::modify(int d)
 {
     theShort *= d;
-    theInt  *= (d*d);
+    theInt = unsigned(theInt) * unsigned(d*d);    // wraps, no overflow
+    if (length + 4 > 256) {return;}
     memcpy(buffer + length, "-<(0", 4);
     length += 4;
 }
 
 // --------------------------------------------------------------
-// this code runs only in the parent process
-void doParentStuff()
+// table entries for the hand-written types, offsets are taken from
+// the member list, so they always agree with the struct layout
+void whatA::registerType()
 {
-    // parent process pipes for input and output
-    close(firstPipe[0]);
-    close(secondPipe[1]);
-    wFile = fdopen(firstPipe[1], "w");
-    rFile = fdopen(secondPipe[0], "r");
+    static const char empty[sizeof(whatA)] = {0};
+    const whatA *p = reinterpret_cast<const whatA *>(empty);
+    whatType entry =
+    {
+        "whatA", sizeof(whatA), 2,
+        {
+            {"theFlt", short((const char *)&p->theFlt - empty), kindF32, 2.0, {0}, 0},
+            {"theDbl", short((const char *)&p->theDbl - empty), kindF64, 4.0, {0}, 0}
+        },
+        ")>-", 3,
+        [](whatBase *what, ostream &os) {static_cast<whatA *>(what)->serialize(os);},
+        [](whatBase *what) {static_cast<whatA *>(what)->modify(2.0);}
+    };
+    addType(typeA, entry);
+}
 
-    // iterate over lines of user input
-    string theString;
-    do  {
-        // parent gets user input
-        theString.clear();
-        cout << "\nType a text string: ";
-        getline(cin, theString);
-        if (!theString.size()) {break;}
+void whatB::registerType()
+{
+    static const char empty[sizeof(whatB)] = {0};
+    const whatB *p = reinterpret_cast<const whatB *>(empty);
+    whatType entry =
+    {
+        "whatB", sizeof(whatB), 2,
+        {
+            {"theShort", short((const char *)&p->theShort - empty), kindI16, 3.0, {0}, 0},
+            {"theInt", short((const char *)&p->theInt - empty), kindI32, 9.0, {0}, 0}
+        },
+        "-<(0", 4,
+        [](whatBase *what, ostream &os) {static_cast<whatB *>(what)->serialize(os);},
+        [](whatBase *what) {static_cast<whatB *>(what)->modify(3);}
+    };
+    addType(typeB, entry);
+}
 
-        // populate a type A instance
-        whatA *myWhatA = reinterpret_cast<whatA *>(xBuff);
-        myWhatA->populate(1.234e5, 2.345e67, theString);
+// hand-written types are in the table before main() runs
+bool builtinTypes = (whatA::registerType(), whatB::registerType(), true);
 
-        // write out to child
-        myWhatA->writeOut(wFile);
-        cout << "[\"pipey\"";
-        myWhatA->serialize(cout);
-        memset(xBuff, 0, sizeof(xBuff));
+// size of fixed members ahead of the string tail, by type
+int whatBase::headSize()
+{
+    int head = typeTable[type & 0xff].head;
+    return head? head: length;
+}
+
+// report method for any packet type
+void whatBase::serialize(ostream &os)
+{
+    whatType &entry = typeTable[type & 0xff];
+    if (entry.serialize) {entry.serialize(this, os);}
+    else {(packMode? cerr: os) << "Unknown type: " << type << ", pid: " << pid << endl;}
+}
+
+// child side processing for any packet type
+void whatBase::modify()
+{
+    whatType &entry = typeTable[type & 0xff];
+    if (entry.modify) {entry.modify(this);}
+}
+
+// report method for types from a schema, same layout as whatA
+void whatBase::serializeFields(whatBase *what, ostream &os)
+{
+    // check for plausible input
+    whatType &entry = typeTable[what->type & 0xff];
+    if (what->length < entry.head || what->length > 256)
+    {
+        (packMode? cerr: os) << "Bad length: " << what->length << ", pid: " << pid << endl;
+        return;
+    }
+    const char *str = reinterpret_cast<char *>(what->buffer) + entry.head;
+    int cSize = what->length - entry.head;
+
+    // compact form, hex bytes optional, built in memory with the
+    // field names packed ahead of time, and written at once
+    if (packMode)
+    {
+        unsigned char out[1024], *at = out;
+        *at++ = 0x80 | (entry.fields + (packHex? 4: 3));
+        at = packStr(at, "length", 6);
+        at = packInt(at, what->length);
+        at = packStr(at, "type", 4);
+        at = packInt(at, what->type);
+        for (int n = 0; n < entry.fields; n++)
+        {
+            const whatField &f = entry.field[n];
+            memcpy(at, f.key, f.keySize);
+            at = fieldKinds[f.kind].pack(at + f.keySize, what->buffer + f.offset);
+        }
+        at = packStr(at, "theStr", 6);
+        at = packStr(at, str, cSize);
+        if (packHex)
+        {
+            at = packStr(at, "hex", 3);
+            at = packBin(at, what->buffer, what->length);
+        }
+        os.write(reinterpret_cast<char *>(out), at - out);
+        return;
+    }
+
+    // show struct data members first
+    os << dec << setprecision(8)
+        << ",{\"length\":" << what->length
+        << ",\"type\":" << what->type;
+    for (int n = 0; n < entry.fields; n++)
+    {
+        os << ",\"" << entry.field[n].name << "\":";
+        fieldKinds[entry.field[n].kind].show(os, what->buffer + entry.field[n].offset);
+    }
+    os << ",\"theStr\":\"";
+    os.write(str, cSize) << "\"";
+
+    // then show buffer contents as hex bytes
+    what->showHex(os);
+    os << '}' << endl;
+}
+
+// modify values for types from a schema, no trailing null
+void whatBase::modifyFields(whatBase *what)
+{
+    whatType &entry = typeTable[what->type & 0xff];
+    for (int n = 0; n < entry.fields; n++)
+    {
+        fieldKinds[entry.field[n].kind].scale(what->buffer + entry.field[n].offset, entry.field[n].scale);
+    }
+    if (what->length + entry.markerSize > 256) {return;}
+    memcpy(what->buffer + what->length, entry.marker, entry.markerSize);
+    what->length += entry.markerSize;
+}
+
+// initialization method for any registered type, every fixed
+// member is set to value, return false if type is unknown or
+// string is too long
+bool whatBase::populate(int id, long value, const string &c)
+{
+    // check for plausible input
+    whatType &entry = typeTable[id & 0xff];
+    int cSize = c.size();
+    if (!entry.head || cSize > 256 - entry.head)
+    {
+        cerr << "Bad type: " << id << " or string size: " << cSize
+            << ", limit: " << 256 - entry.head << endl;
+        return false;
+    }
+
+    // copy data members into memory, no trailing null
+    packValue v;
+    v.kind = 'i';
+    v.i = value;
+    length = entry.head + cSize;
+    type = typeEnum(id);
+    for (int n = 0; n < entry.fields; n++)
+    {
+        fieldKinds[entry.field[n].kind].put(buffer + entry.field[n].offset, v);
+    }
+    c.copy(reinterpret_cast<char *>(buffer) + entry.head, cSize);
+    return true;
+}
+
+// set fixed members and string of any registered type from named
+// values, return false if type is unknown or string does not fit
+bool whatBase::rebuild(int id, const vector<pair<string, packValue> > &values)
+{
+    whatType &entry = typeTable[id & 0xff];
+    if (!entry.head) {return false;}
+    length = entry.head;
+    type = typeEnum(id);
+    for (size_t v = 0; v < values.size(); v++)
+    {
+        if (values[v].first == "theStr")
+        {
+            int cSize = values[v].second.s.size();
+            if (cSize > 256 - entry.head) {return false;}
+            values[v].second.s.copy(reinterpret_cast<char *>(buffer) + entry.head, cSize);
+            length = entry.head + cSize;
+        }
+        for (int n = 0; n < entry.fields; n++)
+        {
+            if (values[v].first != entry.field[n].name) {continue;}
+            fieldKinds[entry.field[n].kind].put(buffer + entry.field[n].offset, values[v].second);
+        }
+    }
+    return true;
+}
+
+// add one type from a schema line, return false if line is bad:
+//   id name marker field:kind[*scale] ...
+// kind is one of i8 i16 i32 i64 f32 f64, marker "-" means none,
+// scale must be a number, and a whole one for integer kinds
+bool registerLine(const string &line)
+{
+    istringstream is(line);
+    int id;
+    string name, marker, field;
+    if (!(is >> id >> name >> marker) || id < 1 || id > 255 || typeTable[id].head
+        || name.size() >= sizeof(whatType::name) || marker.size() >= sizeof(whatType::marker))
+    {
+        return false;
+    }
+
+    whatType entry;
+    memset(&entry, 0, sizeof(entry));
+    name.copy(entry.name, name.size());
+    if (marker != "-") {entry.markerSize = marker.copy(entry.marker, marker.size());}
+    entry.head = 8;
+    while (is >> field)
+    {
+        // split name:kind*scale, scale defaults to one
+        size_t colon = field.find(':'), star = field.find('*');
+        if (colon == string::npos || colon >= sizeof(whatField::name)
+            || entry.fields == 8) {return false;}
+        string kind = field.substr(colon + 1, star - colon - 1);
+        whatField &f = entry.field[entry.fields];
+        for (f.kind = 0; f.kind < kindCount && kind != fieldKinds[f.kind].name; f.kind++) {}
+        if (f.kind == kindCount) {return false;}
+        field.copy(f.name, colon);
+        f.offset = entry.head;
+        f.scale = 1.0;
+        if (star != string::npos)
+        {
+            const char *from = field.c_str() + star + 1;
+            char *end;
+            f.scale = strtod(from, &end);
+            if (end == from || *end || !(fabs(f.scale) < 9.2e18)) {return false;}
+            if (f.kind < kindF32 && f.scale != long(f.scale)) {return false;}
+        }
+        entry.head += fieldKinds[f.kind].size;
+        entry.fields++;
+    }
+    if (entry.head > 256 - entry.markerSize) {return false;}
+    entry.serialize = whatBase::serializeFields;
+    entry.modify = whatBase::modifyFields;
+    addType(id, entry);
+    schemaTypes.push_back(id);
+    return true;
+}
+
+// load types from a schema file, skipping blank and # lines
+bool loadSchema(const char *path)
+{
+    ifstream file(path);
+    if (!file)
+    {
+        cerr << "Failed to open schema: " << path << endl;
+        return false;
+    }
+    string line;
+    for (int n = 1; getline(file, line); n++)
+    {
+        size_t first = line.find_first_not_of(" \t");
+        if (first == string::npos || line[first] == '#') {continue;}
+        if (registerLine(line)) {continue;}
+        cerr << "Bad schema line " << n << ": " << line << endl;
+        return false;
+    }
+    return true;
+}
+
+// --------------------------------------------------------------
+// memory and processor placement for the transport buffers
+
+// node of the processor the calling thread runs on
+int thisNode()
+{
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, 0)) {return -1;}
+    return node;
+}
+
+// map pool memory, optionally on 2 MB huge pages, preferring the
+// node of the calling thread, pre-faulted so first use is cheap.
+// Falls back to transparent huge pages, then to normal pages.
+void *allocPool(size_t bytes)
+{
+    const size_t hugeSize = 2 << 20;
+    void *pool = MAP_FAILED;
+    if (useHuge)
+    {
+        bytes = (bytes + hugeSize - 1) & ~(hugeSize - 1);
+        pool = mmap(0, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        static bool warned = false;
+        if (pool == MAP_FAILED && !warned)
+        {
+            cerr << "No huge pages, trying THP." << endl;
+            warned = true;
+        }
+    }
+    if (pool == MAP_FAILED)
+    {
+        pool = mmap(0, bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool == MAP_FAILED) {return 0;}
+        if (useHuge) {madvise(pool, bytes, MADV_HUGEPAGE);}
+    }
+
+    // prefer local node (MPOL_PREFERRED), best effort only
+    int node = thisNode();
+    if (node >= 0 && node < 64)
+    {
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, pool, bytes, 1, &mask, 64, 0);
+    }
+    memset(pool, 0, bytes);
+    return pool;
+}
+
+// pin calling process to one processor, return false on failure
+bool pinTo(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (!sched_setaffinity(0, sizeof(set), &set)) {return true;}
+    cerr << "Failed to pin to cpu: " << cpu << ", pid: " << pid << endl;
+    return false;
+}
+
+// next processor after cpu on the same node, or cpu itself
+int nearCpu(int cpu)
+{
+    char path[80];
+    for (int node = 0; node < 64; node++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpu%d", node, cpu);
+        if (access(path, F_OK)) {continue;}
+
+        // cpulist is ranges such as 0-3,8-11
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (!file) {break;}
+        int first = -1, lo, hi, near = -1;
+        while (fscanf(file, "%d", &lo) == 1)
+        {
+            hi = lo;
+            if (fscanf(file, "-%d", &hi) != 1) {hi = lo;}
+            if (first < 0) {first = lo;}
+            if (near < 0 && hi > cpu) {near = (lo > cpu)? lo: cpu + 1;}
+            if (fgetc(file) != ',') {break;}
+        }
+        fclose(file);
+        if (near < 0) {near = first;}
+        return (near < 0)? cpu: near;
+    }
+    return cpu;
+}
+
+// monotonic time in seconds
+double timeNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// raw monotonic time in nanoseconds, not slewed by NTP, for stamps
+long clockNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// busy-poll for input up to the spin budget, so a packet that comes
+// soon is read without the sleep and wakeup of a blocking read,
+// the caller then reads as usual, blocking only if the spin ran out.
+// Yielding costs nothing on an isolated core, and lets a peer that
+// shares the processor run instead of waiting out the budget.
+void spinWait(FILE *file)
+{
+    struct pollfd pfd = {fileno(file), POLLIN, 0};
+    long until = clockNs() + spinBudget * 1000;
+    while (!poll(&pfd, 1, 0) && clockNs() < until) {sched_yield();}
+}
+
+// --------------------------------------------------------------
+// bounded queue of packets waiting for credit to go to the child,
+// with a policy for what to do when a packet arrives to a full
+// queue.  Slots are fixed size, so memory is bounded by budget,
+// and come from the pool allocator, so they may be huge pages.
+class whatQueue
+{
+public:
+    // enumerator identifies overflow policies
+    enum policyEnum
+    {
+        policyBlock,    // caller waits for room
+        policyOldest,   // drop the oldest queued packet
+        policyNewest,   // drop the arriving packet
+        policyCoalesce  // replace queued packet of same type
+    };
+
+    // instance methods
+    bool init(int size);
+    bool push(whatBase *what, enum policyEnum policy, const whatTrace &trace);
+    whatBase *front() {return reinterpret_cast<whatBase *>(slots[head]);}
+    whatTrace *frontTrace() {return traces[head].seq? &traces[head]: 0;}
+    void pop() {head = (head + 1) % size; depth--;}
+    int queueDepth() {return depth;}
+    bool full() {return depth == size;}
+    void report(ostream &os);
+
+    // counters, one per way a packet can leave
+    long sent, dropOldest, dropNewest, coalesced, rejected, maxDepth;
+
+private:
+    unsigned char (*slots)[256];
+    whatTrace *traces;
+    int size, head, depth;
+};
+
+// allocate slots and their trace records, return false if out of memory
+bool whatQueue::init(int n)
+{
+    slots = static_cast<unsigned char (*)[256]>(allocPool(n * 256));
+    traces = static_cast<whatTrace *>(allocPool(n * sizeof(whatTrace)));
+    size = n;
+    head = depth = 0;
+    sent = dropOldest = dropNewest = coalesced = rejected = maxDepth = 0;
+    return slots != 0 && traces != 0;
+}
+
+// add a copy of packet and its trace record, applying policy if
+// queue is full, return false if the packet did not go into the queue
+bool whatQueue::push(whatBase *what, enum policyEnum policy, const whatTrace &trace)
+{
+    // header alone is 8 bytes, anything less was never populated
+    if (what->getLength() < 8 || what->getLength() > 256)
+    {
+        rejected++;
+        return false;
+    }
+    if (full())
+    {
+        switch (policy)
+        {
+            case policyCoalesce:
+                // newest queued packet of the same type wins
+                for (int n = depth - 1; n >= 0; n--)
+                {
+                    int at = (head + n) % size;
+                    whatBase *old = reinterpret_cast<whatBase *>(slots[at]);
+                    if (old->getType() == what->getType())
+                    {
+                        memcpy(old, what, what->getLength());
+                        traces[at] = trace;
+                        coalesced++;
+                        return true;
+                    }
+                }
+                // no match, so drop oldest
+                // fall through
+
+            case policyOldest:
+                pop();
+                dropOldest++;
+                break;
+
+            case policyNewest:
+            case policyBlock:
+                dropNewest++;
+                return false;
+        }
+    }
+    memcpy(slots[(head + depth) % size], what, what->getLength());
+    traces[(head + depth) % size] = trace;
+    if (++depth > maxDepth) {maxDepth = depth;}
+    return true;
+}
+
+// show counters in Json
+void whatQueue::report(ostream &os)
+{
+    os << "{\"sent\":" << sent
+        << ",\"dropOldest\":" << dropOldest
+        << ",\"dropNewest\":" << dropNewest
+        << ",\"coalesced\":" << coalesced
+        << ",\"rejected\":" << rejected
+        << ",\"maxDepth\":" << maxDepth
+        << ",\"depth\":" << depth << '}';
+}
+
+// packets waiting to go to the child, and the number that may
+// still be sent before a reply comes back.  The child returns one
+// packet for each it receives, so every reply is one credit.  Keeping
+// window times 256 bytes under the pipe capacity means neither side
+// ever blocks in writeOut.
+whatQueue sendQueue;
+enum whatQueue::policyEnum policy = whatQueue::policyBlock;
+int credits;
+long benchBytes;
+
+// send times of packets in flight, replies come back in order, and
+// round trip times kept for the benchmark report
+long sendStamp[64];
+long stampNext, stampDone;
+vector<long> roundTrips;
+
+// time main() started, and from then to the first reply
+long mainStart, firstReply;
+
+// sampled trace records, the one for the packet being populated,
+// those of packets in flight, in step with sendStamp, and the ring
+// of completed records
+whatTrace pending, inFlight[64];
+long traceCount;
+traceRing traceLog;
+
+// start a trace record for the next packet, one in traceEvery
+void traceBegin()
+{
+    pending.seq = 0;
+    if (!traceEvery || ++traceCount % traceEvery) {return;}
+    pending.seq = traceCount / traceEvery;
+    traceStamp(pending, stampPopulate, clockNs());
+}
+
+// --------------------------------------------------------------
+// this code runs only in the parent process
+
+// true if a reply can be read without blocking
+bool replyReady()
+{
+    struct pollfd pfd = {fileno(rFile), POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// read one reply from child and show it, return one credit
+bool readReply()
+{
+    whatBase *myWhat = reinterpret_cast<whatBase *>(rBuff);
+    whatTrace reply;
+    if (spinBudget) {spinWait(rFile);}
+    if (myWhat->readIn(rFile, &rDict, &reply) == whatBase::typeNone)
+    {
+        cerr << "Type not set." << endl;
+        credits = window;
+        return false;
+    }
+    if (!firstReply) {firstReply = clockNs() - mainStart;}
+    whatTrace &trace = inFlight[stampDone % 64];
+    long stamp = sendStamp[stampDone++ % 64];
+    if (benchMode) {roundTrips.push_back(clockNs() - stamp);}
+
+    // take the child stamps, record is lost if the reply had no room
+    if (trace.seq && reply.seq == trace.seq)
+    {
+        trace.pid = reply.pid;
+        trace.delta[stampChildRead - 1] = reply.delta[stampChildRead - 1];
+        trace.delta[stampModified - 1] = reply.delta[stampModified - 1];
+        traceStamp(trace, stampReplyRead, clockNs());
+    }
+    else {trace.seq = 0;}
+    benchBytes += myWhat->getLength();
+    if (!benchMode) {myWhat->serialize(cout);}
+    if (trace.seq)
+    {
+        traceStamp(trace, stampSerialized, clockNs());
+        traceLog.push(trace);
+    }
+    memset(rBuff, 0, sizeof(rBuff));
+    credits++;
+    return true;
+}
+
+// send queued packets as credit allows, reading replies that are
+// already waiting while a backlog remains, or when all is set,
+// wait until queue is empty and every reply is back
+void pumpQueue(bool all)
+{
+    do  {
+        while (credits && sendQueue.queueDepth())
+        {
+            whatBase *myWhat = sendQueue.front();
+            whatTrace *trace = sendQueue.frontTrace();
+            whatTrace &sent = inFlight[stampNext % 64];
+            long now = clockNs();
+            sendStamp[stampNext++ % 64] = now;
+            if (trace) {traceStamp(*trace, stampSend, now);}
+            myWhat->writeOut(wFile, useDict? &wDict: 0, trace);
+            sent.seq = 0;
+            if (trace) {sent = *trace; traceStamp(sent, stampWritten, clockNs());}
+            if (captureFile) {fwrite(myWhat, 1, myWhat->getLength(), captureFile);}
+            benchBytes += myWhat->getLength();
+            if (!benchMode) {myWhat->serialize(cout);}
+            sendQueue.pop();
+            sendQueue.sent++;
+            credits--;
+        }
+        if (credits == window && !sendQueue.queueDepth()) {return;}
+        if (!all && (!sendQueue.queueDepth() || !replyReady())) {return;}
+    }   while (readReply());
+}
+
+// queue packet for child, waiting for room only if policy says so,
+// the queue keeps a copy, so the packet buffer is cleared for the next
+void sendPacket(whatBase *myWhat)
+{
+    // waiting for room is part of the queue span
+    if (pending.seq) {traceStamp(pending, stampQueued, clockNs());}
+    while (policy == whatQueue::policyBlock && sendQueue.full())
+    {
+        if (!readReply()) {return;}
+        pumpQueue(false);
+    }
+    sendQueue.push(myWhat, policy, pending);
+    memset(myWhat, 0, myWhat->getLength());
+    pumpQueue(false);
+}
+
+// mark the start and end of each group of round trips, the
+// packed stream only marks the start, as the string "pipey"
+void beginGroup(ostream &os)
+{
+    if (packMode) {packStr(os, "pipey");}
+    else {os << "[\"pipey\"";}
+}
+
+void endGroup(ostream &os)
+{
+    if (!packMode) {os << ']';}
+    os << flush;
+}
+
+// generate samples without user input, unless blocking is the
+// policy, halve the sampling rate while the queue is over half
+// full and double it again once the queue is empty.  The rate only
+// changes after a sample is sent, and skipped samples keep the
+// queue draining, so it can recover.
+void doAcquire()
+{
+    string theString;
+    int stride = 1;
+    long skipped = 0;
+    double start = timeNow();
+    if (benchMode) {roundTrips.reserve(2 * sampleCount);}
+    beginGroup(cout);
+    for (long n = 0; n < sampleCount; n++)
+    {
+        if (n % stride)
+        {
+            skipped++;
+            pumpQueue(false);
+            continue;
+        }
+
+        // populate a type A instance
+        theString = "chan-" + to_string(n % 4);
+        whatA *myWhatA = reinterpret_cast<whatA *>(xBuff);
+        traceBegin();
+        if (myWhatA->populate(n, n * 0.5, theString)) {sendPacket(myWhatA);}
 
         // populate a type B instance
         whatB *myWhatB = reinterpret_cast<whatB *>(xBuff);
-        myWhatB->populate(0x1234, 0x123456, theString);
+        traceBegin();
+        if (myWhatB->populate(n, n, theString)) {sendPacket(myWhatB);}
 
-        // write out to child
-        myWhatB->writeOut(wFile);
-        myWhatB->serialize(cout);
-        memset(xBuff, 0, sizeof(xBuff));
+        // and one of each type from the schema
+        whatBase *myWhat = reinterpret_cast<whatBase *>(xBuff);
+        for (size_t t = 0; t < schemaTypes.size(); t++)
+        {
+            traceBegin();
+            if (myWhat->populate(schemaTypes[t], n, theString)) {sendPacket(myWhat);}
+        }
+
+        // adjust the rate to the queue this sample left behind
+        int depth = sendQueue.queueDepth();
+        if (policy == whatQueue::policyBlock) {}
+        else if (depth > budget / 2 && stride < 64) {stride *= 2;}
+        else if (!depth && stride > 1) {stride /= 2;}
+    }
+    pumpQueue(true);
+    endGroup(cout);
+    if (!packMode) {cout << endl;}
+    cerr << "{\"skipped\":" << skipped << ",\"queue\":";
+    sendQueue.report(cerr);
+
+    // throughput counts bytes both ways, without serialize
+    if (benchMode)
+    {
+        double elapsed = timeNow() - start;
+        cerr << ",\"bench\":{\"seconds\":" << elapsed
+            << ",\"packetsPerSec\":" << 2 * sendQueue.sent / elapsed
+            << ",\"MBPerSec\":" << benchBytes / elapsed / 1e6
+            << ",\"huge\":" << (useHuge? "true": "false")
+            << ",\"cpu\":" << pinCpu << ",\"spinUs\":" << spinBudget
+            << ",\"firstPacketUs\":" << firstReply * 1e-3
+            << ",\"attached\":" << (attachPath? "true": "false");
 
-        // read two packets back from child
-        for (int n = 0; n < 2; n++)
+        // round trip tail latency in microseconds
+        sort(roundTrips.begin(), roundTrips.end());
+        cerr << ",\"roundTripUs\":{";
+        static const double ranks[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+        static const char *names[] = {"p50", "p90", "p99", "p999", "max"};
+        for (int n = 0; n < 5 && roundTrips.size(); n++)
         {
-            switch(myWhatA->readIn(rFile))
-            {
-                case whatBase::typeA:
-                    myWhatA->serialize(cout);
-                    break;
+            size_t at = min(roundTrips.size() - 1, size_t(ranks[n] * roundTrips.size()));
+            cerr << (n? ",\"": "\"") << names[n] << "\":" << roundTrips[at] * 1e-3;
+        }
+        cerr << "}}";
+    }
+    cerr << '}' << endl;
+}
 
-                case whatBase::typeB:
-                    myWhatB->serialize(cout);
-                    break;
+// iterate over lines of user input
+void doInteractive()
+{
+    string theString;
+    do  {
+        // parent gets user input
+        theString.clear();
+        *textOut << "\nType a text string: " << flush;
+        getline(cin, theString);
+        if (!theString.size()) {break;}
 
-                case whatBase::typeNone:
-                    cerr << "Type not set." << endl;
-                    break;
-            }
+        // populate a type A instance
+        beginGroup(cout);
+        whatA *myWhatA = reinterpret_cast<whatA *>(xBuff);
+        traceBegin();
+        if (myWhatA->populate(1.234e5, 2.345e67, theString)) {sendPacket(myWhatA);}
+
+        // populate a type B instance
+        whatB *myWhatB = reinterpret_cast<whatB *>(xBuff);
+        traceBegin();
+        if (myWhatB->populate(0x1234, 0x123456, theString)) {sendPacket(myWhatB);}
+
+        // populate one of each type from the schema
+        whatBase *myWhat = reinterpret_cast<whatBase *>(xBuff);
+        for (size_t t = 0; t < schemaTypes.size(); t++)
+        {
+            traceBegin();
+            if (myWhat->populate(schemaTypes[t], 0x12, theString)) {sendPacket(myWhat);}
         }
-        cout << ']';
+
+        // wait for all packets back from child
+        pumpQueue(true);
+        endGroup(cout);
     }   while (true);
+}
+
+void doParentStuff(int rfd, int wfd)
+{
+    // parent process pipes for input and output
+    wFile = fdopen(wfd, "w");
+    rFile = fdopen(rfd, "r");
+
+    // replies are polled, so nothing may hide in a stdio buffer
+    setvbuf(rFile, 0, _IONBF, 0);
+    credits = window;
+    if (!sendQueue.init(budget))
+    {
+        cerr << "Failed to allocate queue: " << budget << endl;
+        return;
+    }
+    if (sampleCount) {doAcquire();} else {doInteractive();}
+
+    // sampled traces, for chrome://tracing or ui.perfetto.dev
+    if (traceEvery)
+    {
+        ofstream traceFile(traceOut);
+        if (traceFile) {traceLog.exportJson(traceFile, getpid());}
+        else {cerr << "Failed to write trace: " << traceOut << endl;}
+    }
 
     // clean up and exit
+    if (captureFile) {fclose(captureFile);}
     fclose(wFile);
     fclose(rFile);
 }
 
 // --------------------------------------------------------------
 // this code runs only in the child process
-void doChildStuff()
+void doChildStuff(int rfd, int wfd)
 {
     // child process pipes for input and output
-    close(firstPipe[1]);
-    close(secondPipe[0]);
-    rFile = fdopen(firstPipe[0], "r");
-    wFile = fdopen(secondPipe[1], "w");
+    rFile = fdopen(rfd, "r");
+    wFile = fdopen(wfd, "w");
+
+    // spinning polls the pipe, so nothing may hide in a stdio buffer
+    if (spinBudget) {setvbuf(rFile, 0, _IONBF, 0);}
 
     // iterate over packets sent from parent
     // fread() blocks until parent closes the pipe
     do  {
         // check packet type, modify values accordingly
         whatBase *myWhat = reinterpret_cast<whatBase *>(xBuff);
-        switch (myWhat->readIn(rFile))
+        whatTrace trace;
+        if (spinBudget) {spinWait(rFile);}
+        if (myWhat->readIn(rFile, &rDict, &trace) == whatBase::typeNone)
         {
-            case whatBase::typeA:
-                static_cast<whatA *>(myWhat)->modify(2.0);
-                break;
-
-            case whatBase::typeB:
-                static_cast<whatB *>(myWhat)->modify(3);
-                break;
-
-            case whatBase::typeNone:
-                cout << "Child done." << endl;
-                fclose(rFile);
-                fclose(wFile);
-                return;
+            *textOut << "Child done." << endl;
+            fclose(rFile);
+            fclose(wFile);
+            return;
+        }
+        if (trace.seq)
+        {
+            trace.pid = getpid();
+            traceStamp(trace, stampChildRead, clockNs());
         }
+        myWhat->modify();
+        if (trace.seq) {traceStamp(trace, stampModified, clockNs());}
 
         // write the instance back out, common to all packet types
-        myWhat->writeOut(wFile);
+        // use a dictionary only once the parent has shown it can
+        myWhat->writeOut(wFile, rDict.entries()? &wDict: 0, trace.seq? &trace: 0);
         memset(xBuff, 0, sizeof(xBuff));
     }   while (true);
 }
 
 // --------------------------------------------------------------
-// main entry point
+// pre-forked service of warm child processes.  Workers are forked
+// once, fault in their buffers, and then each waits in accept() on
+// one shared socket, so a new session skips pipe(), fork() and the
+// copy-on-write faults, and attaches to a worker that is ready.
+
+// write every page of a region, taking its faults now
+void touchPages(void *region, size_t bytes)
+{
+    volatile char *p = static_cast<char *>(region);
+    for (size_t n = 0; n < bytes; n += 4096) {p[n] = p[n];}
+}
+
+// run sessions one after another, in a worker process
+void doWorker(int listenFd)
+{
+    // own private copies of globals, and keep them resident
+    touchPages(xBuff, sizeof(xBuff));
+    touchPages(rBuff, sizeof(rBuff));
+    touchPages(&rDict, sizeof(rDict));
+    touchPages(&wDict, sizeof(wDict));
+    // pages already touched only, MCL_FUTURE would make later
+    // allocations fail once RLIMIT_MEMLOCK is reached
+    if (mlockall(MCL_CURRENT))
+    {
+        cerr << "Failed to lock pages: " << strerror(errno) << ", pid: " << getpid() << endl;
+    }
+
+    // a client that goes away ends only its own session
+    signal(SIGPIPE, SIG_IGN);
+    while (true)
+    {
+        int fd = accept(listenFd, 0, 0);
+        if (fd < 0 && errno == EINTR) {continue;}
+        if (fd < 0) {_exit(1);}
+        rDict.clear();
+        wDict.clear();
+        doChildStuff(fd, dup(fd));
+    }
+}
+
+// set by SIGTERM or SIGINT, the service then stops its workers
+volatile sig_atomic_t serveStop;
+
+void onServeStop(int) {serveStop = 1;}
+
+// start one worker on a processor of its own, or anywhere if cpu is
+// negative, return its pid.  A worker dies with the service, even if
+// the service is killed outright.
+pid_t startWorker(int listenFd, int cpu)
+{
+    pid_t service = getpid();
+    pid_t worker = fork();
+    if (!worker)
+    {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != service) {_exit(1);}
+        if (cpu >= 0) {pinTo(cpu);}
+        doWorker(listenFd);
+    }
+    else if (worker < 0) {cerr << "Fork failed: " << worker << endl;}
+    return worker;
+}
+
+// listen on a local socket, keep the pool of workers full
+int doServe()
+{
+    struct sockaddr_un addr = {AF_UNIX, {0}};
+    strncpy(addr.sun_path, servePath, sizeof(addr.sun_path) - 1);
+    // replace a stale socket, never anything else
+    struct stat st;
+    if (!lstat(servePath, &st))
+    {
+        if (!S_ISSOCK(st.st_mode) || unlink(servePath))
+        {
+            cerr << "Not a socket, or cannot remove: " << servePath << endl;
+            return -5;
+        }
+    }
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr))
+        || listen(listenFd, 64))
+    {
+        cerr << "Failed to listen on: " << servePath << endl;
+        return -5;
+    }
+
+    // stop cleanly on a signal, wait() must not restart after one
+    struct sigaction action = {};
+    action.sa_handler = onServeStop;
+    sigaction(SIGTERM, &action, 0);
+    sigaction(SIGINT, &action, 0);
+
+    // fault in globals once, workers then start from warm pages,
+    // spread from the child processor over the processors of its node
+    touchPages(xBuff, sizeof(xBuff));
+    touchPages(&rDict, sizeof(rDict));
+    touchPages(&wDict, sizeof(wDict));
+    vector<pid_t> workers(serveWorkers);
+    vector<int> cpus(serveWorkers, -1);
+    int result = 0;
+    for (int n = 0; n < serveWorkers; n++)
+    {
+        if (childCpu >= 0 || pinCpu >= 0)
+        {
+            cpus[n] = n? nearCpu(cpus[n - 1]): (childCpu >= 0)? childCpu: nearCpu(pinCpu);
+        }
+        workers[n] = startWorker(listenFd, cpus[n]);
+        if (workers[n] < 0) {serveStop = 1; result = -2; break;}
+    }
+    if (!serveStop) {*textOut << "Serving " << serveWorkers << " workers on: " << servePath << endl;}
+
+    // replace any worker that exits, on the same processor
+    int status;
+    while (!serveStop)
+    {
+        pid_t done = wait(&status);
+        if (done < 0 && errno == EINTR) {continue;}
+        if (done < 0) {break;}
+        cerr << "Worker exited: " << done << ", status: " << status << endl;
+        size_t n = find(workers.begin(), workers.end(), done) - workers.begin();
+        if (n == workers.size()) {continue;}
+        workers[n] = startWorker(listenFd, cpus[n]);
+        if (workers[n] < 0) {result = -2; break;}
+    }
+
+    // take the workers and the socket down with the service
+    for (size_t n = 0; n < workers.size(); n++)
+    {
+        if (workers[n] > 0) {kill(workers[n], SIGTERM);}
+    }
+    while (wait(&status) > 0 || errno == EINTR) {}
+    close(listenFd);
+    unlink(servePath);
+    return result;
+}
+
+// connect to a running service, return socket or -1
+int attachTo(const char *path)
+{
+    struct sockaddr_un addr = {AF_UNIX, {0}};
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && !connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {return fd;}
+    if (fd >= 0) {close(fd);}
+    return -1;
+}
+
+// --------------------------------------------------------------
+// convert a packed stream back to the Json that serialize() writes,
+// rebuilding each packet from its hex bytes if present, otherwise
+// from its fields, return false on bad input
+bool packToJson(istream &is, ostream &os)
+{
+    static char pkt[256];
+    bool open = false, good = true;
+    packValue v, key;
+    while (good && is.peek() != EOF)
+    {
+        // a string starts a group, anything else must be a map
+        if (!unpackValue(is, v) || (v.kind != 's' && v.kind != 'm')) {good = false; break;}
+        if (v.kind == 's')
+        {
+            os << (open? "]": "") << "[\"" << v.s << '"';
+            open = true;
+            continue;
+        }
+
+        // collect fields by name
+        vector<pair<string, packValue> > values;
+        long length = -1, type = 0;
+        string hex;
+        for (long n = 0; good && n < v.i; n++)
+        {
+            packValue f;
+            good = unpackValue(is, key) && key.kind == 's' && unpackValue(is, f);
+            if (!good) {break;}
+            if (key.s == "length") {length = f.i;}
+            else if (key.s == "type") {type = f.i;}
+            else if (key.s == "hex") {hex = f.s;}
+            else {values.push_back(make_pair(key.s, f));}
+        }
+        if (!good) {break;}
+
+        // rebuild packet and show it the usual way
+        memset(pkt, 0, sizeof(pkt));
+        whatBase *myWhat = reinterpret_cast<whatBase *>(pkt);
+        if (hex.size() >= 8 && hex.size() <= sizeof(pkt))
+        {
+            hex.copy(pkt, hex.size());
+            if (!whatBase::knownType(pkt)) {good = false; break;}
+        }
+        else if (type < 0 || type > 255 || !myWhat->rebuild(type, values)) {good = false; break;}
+        if (myWhat->getLength() != length || myWhat->getType() != type
+            || (hex.size() && long(hex.size()) != length)) {good = false; break;}
+        myWhat->serialize(os);
+    }
+    if (open) {os << ']' << endl;}
+    return good;
+}
+
+// --------------------------------------------------------------
+// offline replay of capture files on all processors.  A capture
+// holds packets as populate() lays them out, back to back, as the
+// parent writes them with --capture.  One thread maps each file in
+// turn and cuts it into chunks at packet boundaries, reading ahead
+// of itself, while chunks already cut go through serialize() and
+// modify() in parallel.  Outputs are written in original order, and
+// each file is unmapped once its last chunk is written.
+
+struct replayChunk
+{
+    const char *data;       // first packet in chunk
+    size_t size;            // bytes, whole packets only
+    bool first, last;       // chunk opens or closes its file group
+    bool done;              // output is ready to write
+    long packets;
+    string out;
+    void *map;              // whole file, on its last chunk only
+    size_t mapSize;
+};
+
+// chunks not yet written, in file order, shared by the splitter,
+// workers and writer under replayLock.  Chunk numbers count from
+// the start of the replay, the deque starts at replayWritten, and
+// replayNext is the next chunk to run.  Neither splitter nor workers
+// get more than replayAhead chunks ahead of the writer, so the deque,
+// mapped input and held output all stay bounded.
+deque<replayChunk> replayChunks;
+mutex replayLock;
+condition_variable replayReady;
+size_t replayNext, replayWritten, replayAhead;
+bool replaySplit;
+
+// chunk numbers past the last one cut
+size_t replayCut() {return replayWritten + replayChunks.size();}
+
+// run one chunk, the same steps as a round trip through the child
+void replayOne(replayChunk &chunk)
+{
+    char pkt[256];
+    ostringstream os;
+    whatBase *myWhat = reinterpret_cast<whatBase *>(pkt);
+    if (chunk.first) {beginGroup(os);}
+    for (size_t at = 0; at < chunk.size; chunk.packets++)
+    {
+        int length;
+        memcpy(&length, chunk.data + at, 4);
+        memcpy(pkt, chunk.data + at, length);
+        at += length;
+        myWhat->serialize(os);
+        myWhat->modify();
+        myWhat->serialize(os);
+    }
+    if (chunk.last) {endGroup(os);}
+    if (chunk.last && !packMode) {os << endl;}
+    chunk.out = os.str();
+}
+
+// hand a chunk to the workers, waiting while far enough ahead
+void addChunk(const replayChunk &chunk)
+{
+    unique_lock<mutex> guard(replayLock);
+    replayReady.wait(guard, []() {return replayChunks.size() < replayAhead;});
+    replayChunks.push_back(chunk);
+    replayReady.notify_all();
+}
+
+// cut one mapped file into chunks of about 1 MB, checking each
+// length and type on the way, a bad one ends the file with a notice.  The
+// next two chunks are read ahead while this one is cut.
+void splitFile(const char *name, void *map, size_t size)
+{
+    const size_t chunkSize = 1 << 20;
+    const char *data = static_cast<char *>(map);
+    size_t at = 0, start = 0;
+    replayChunk chunk = {data, 0, true, false, false, 0, string(), 0, 0};
+    madvise(map, min(size, 2 * chunkSize), MADV_WILLNEED);
+    while (at + 4 <= size)
+    {
+        int length;
+        memcpy(&length, data + at, 4);
+        if (length < 8 || length > 256 || at + length > size || !whatBase::knownType(data + at))
+        {
+            cerr << "Bad packet in: " << name << ", offset: " << at << endl;
+            break;
+        }
+        at += length;
+        if (at - start < chunkSize) {continue;}
+        chunk.data = data + start;
+        chunk.size = at - start;
+        addChunk(chunk);
+        chunk.first = false;
+        start = at;
+
+        // page aligned, as madvise() wants
+        size_t ahead = start & ~size_t(4095);
+        if (ahead < size) {madvise(const_cast<char *>(data) + ahead, min(size - ahead, 2 * chunkSize), MADV_WILLNEED);}
+    }
+
+    // last chunk may be empty, it still closes the group, and
+    // takes the mapping with it
+    chunk.data = data + start;
+    chunk.size = at - start;
+    chunk.last = true;
+    chunk.map = map;
+    chunk.mapSize = size;
+    addChunk(chunk);
+}
+
+// replay every file in directory, in name order
+int doReplay()
+{
+    DIR *dir = opendir(replayDir);
+    if (!dir)
+    {
+        cerr << "Failed to open directory: " << replayDir << endl;
+        return -5;
+    }
+    vector<string> names;
+    while (struct dirent *entry = readdir(dir))
+    {
+        string name = string(replayDir) + '/' + entry->d_name;
+        struct stat st;
+        if (!stat(name.c_str(), &st) && S_ISREG(st.st_mode) && st.st_size) {names.push_back(name);}
+    }
+    closedir(dir);
+    sort(names.begin(), names.end());
+
+    // workers and splitter stay at most a few chunks ahead of
+    // the writer, so memory for inputs and outputs stays bounded
+    if (replayJobs <= 0) {replayJobs = max(1u, thread::hardware_concurrency());}
+    replayAhead = 4 * replayJobs;
+    double start = timeNow();
+    vector<thread> workers;
+    for (int n = 0; n < replayJobs; n++)
+    {
+        workers.push_back(thread([]()
+        {
+            unique_lock<mutex> guard(replayLock);
+            while (true)
+            {
+                replayReady.wait(guard, []() {return replayNext < replayCut() || replaySplit;});
+                if (replayNext >= replayCut()) {return;}
+                replayChunk &chunk = replayChunks[replayNext++ - replayWritten];
+                guard.unlock();
+                replayOne(chunk);
+                guard.lock();
+                chunk.done = true;
+                replayReady.notify_all();
+            }
+        }));
+    }
+
+    // map each regular file lazily, reading ahead as it is cut
+    long files = 0;
+    size_t total = 0;
+    thread splitter([&]()
+    {
+        for (size_t n = 0; n < names.size(); n++)
+        {
+            int fd = open(names[n].c_str(), O_RDONLY);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) || !st.st_size)
+            {
+                cerr << "Failed to open: " << names[n] << endl;
+                if (fd >= 0) {close(fd);}
+                continue;
+            }
+            void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (data == MAP_FAILED)
+            {
+                cerr << "Failed to map: " << names[n] << endl;
+                continue;
+            }
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            splitFile(names[n].c_str(), data, st.st_size);
+            total += st.st_size;
+            files++;
+        }
+        lock_guard<mutex> guard(replayLock);
+        replaySplit = true;
+        replayReady.notify_all();
+    });
+
+    // write outputs in order as they finish, unmap finished files
+    long packets = 0, chunks = 0;
+    while (true)
+    {
+        string out;
+        replayChunk *chunk;
+        {
+            unique_lock<mutex> guard(replayLock);
+            replayReady.wait(guard, []() {return (replaySplit && replayChunks.empty())
+                || (!replayChunks.empty() && replayChunks.front().done);});
+            if (replayChunks.empty()) {break;}
+            chunk = &replayChunks.front();
+            out.swap(chunk->out);
+        }
+        fwrite(out.data(), 1, out.size(), stdout);
+        packets += chunk->packets;
+        chunks++;
+        if (chunk->map) {munmap(chunk->map, chunk->mapSize);}
+        lock_guard<mutex> guard(replayLock);
+        replayChunks.pop_front();
+        replayWritten++;
+        replayReady.notify_all();
+    }
+    splitter.join();
+    for (size_t n = 0; n < workers.size(); n++) {workers[n].join();}
+    fflush(stdout);
+
+    double elapsed = timeNow() - start;
+    cerr << "{\"files\":" << files << ",\"chunks\":" << chunks
+        << ",\"packets\":" << packets << ",\"jobs\":" << replayJobs
+        << ",\"seconds\":" << elapsed << ",\"MBPerSec\":" << total / elapsed / 1e6 << '}' << endl;
+    return 0;
+}
+
+// --------------------------------------------------------------
+// compare table dispatch to a schema type against the hand-written
+// whatA code called directly, as the switch it replaced did, using a
+// schema type with the same layout and scaling
+
+// stream buffer that formats but keeps nothing
+class nullBuf: public streambuf
+{
+protected:
+    int overflow(int c) {return c;}
+    streamsize xsputn(const char *, streamsize n) {return n;}
+};
+
+// time modify() and serialize() for one packet, through whatBase
+// and the type table, or else straight to whatA, return nanoseconds
+// per packet
+double timeType(char *pristine, long count, bool direct)
+{
+    static char pkt[256];
+    nullBuf buf;
+    ostream os(&buf);
+    whatBase *myWhat = reinterpret_cast<whatBase *>(pkt);
+    whatA *myWhatA = reinterpret_cast<whatA *>(pkt);
+    long start = clockNs();
+    for (long n = 0; n < count; n++)
+    {
+        memcpy(pkt, pristine, 256);
+        if (direct)
+        {
+            myWhatA->modify(2.0);
+            myWhatA->serialize(os);
+        }
+        else
+        {
+            myWhat->modify();
+            myWhat->serialize(os);
+        }
+    }
+    return double(clockNs() - start) / count;
+}
+
+int doTypeBench(long count)
+{
+    // same members as whatA, under a free id
+    int id = 1;
+    while (id < 255 && typeTable[id].head) {id++;}
+    if (!registerLine(to_string(id) + " whatA2 )>- theFlt:f32*2 theDbl:f64*4"))
+    {
+        cerr << "Failed to register bench type." << endl;
+        return -4;
+    }
+    // the same values in both layouts
+    static char hand[256], table[256];
+    const string theStr = "thermocouple-7";
+    reinterpret_cast<whatA *>(hand)->populate(1.234e5, 2.345e67, theStr);
+    vector<pair<string, packValue> > values(3);
+    values[0].first = "theFlt";
+    values[0].second.kind = 'f';
+    values[0].second.f = 1.234e5f;
+    values[0].second.exact32 = false;
+    values[1].first = "theDbl";
+    values[1].second.kind = 'f';
+    values[1].second.f = 2.345e67;
+    values[2].first = "theStr";
+    values[2].second.s = theStr;
+    reinterpret_cast<whatBase *>(table)->rebuild(id, values);
+
+    // after modify, all but the type must match
+    static char one[256], two[256];
+    ostringstream s1, s2;
+    whatBase *myOne = reinterpret_cast<whatBase *>(one);
+    whatBase *myTwo = reinterpret_cast<whatBase *>(two);
+    memcpy(one, hand, 256);
+    memcpy(two, table, 256);
+    myOne->modify();
+    myTwo->modify();
+    bool packed = packMode;
+    packMode = false;
+    myOne->serialize(s1);
+    myTwo->serialize(s2);
+    string t1 = s1.str(), t2 = s2.str();
+    size_t from = t1.find("\"theFlt\""), to = t1.find("\"hex\"");
+    bool same = myOne->getLength() == myTwo->getLength()
+        && !memcmp(one + 8, two + 8, myOne->getLength() - 8)
+        && t1.substr(from, to - from) == t2.substr(t2.find("\"theFlt\""), to - from);
+
+    // packed forms differ only in the one byte of the type value,
+    // and in the hex bytes, so those are left out
+    ostringstream p1, p2;
+    bool hex = packHex;
+    packMode = true;
+    packHex = false;
+    myOne->serialize(p1);
+    myTwo->serialize(p2);
+    packMode = packed;
+    packHex = hex;
+    t1 = p1.str();
+    t2 = p2.str();
+    from = t1.find("\xa4type") + 5;
+    same = same && from < t1.size() && t1.size() == t2.size()
+        && t1.erase(from, 1) == t2.erase(from, 1);
+
+    // alternate runs, so drift hits both alike
+    double directNs = 0, handNs = 0, tableNs = 0;
+    for (int round = 0; round < 4; round++)
+    {
+        directNs += timeType(hand, count / 4, true);
+        handNs += timeType(hand, count / 4, false);
+        tableNs += timeType(table, count / 4, false);
+    }
+    cerr << "{\"typeBench\":" << count << ",\"directNs\":" << directNs / 4
+        << ",\"handNs\":" << handNs / 4 << ",\"tableNs\":" << tableNs / 4
+        << ",\"dispatchRatio\":" << handNs / directNs << ",\"ratio\":" << tableNs / directNs
+        << ",\"packed\":" << (packMode? "true": "false")
+        << ",\"same\":" << (same? "true": "false") << '}' << endl;
+    return same? 0: -4;
+}
+
+// --------------------------------------------------------------
+// differential test, every fast path against the reference codec
+
+// populate a random packet, usually with a repeated string
+void randomPacket(char *buff, unsigned &seed)
+{
+    static const char *names[] = {"chan-0", "chan-1", "thermocouple-7", "", "x"};
+    string theString = names[rand_r(&seed) % 5];
+    if (!(rand_r(&seed) % 4)) {theString.assign(rand_r(&seed) % 237, 'a' + rand_r(&seed) % 26);}
+
+    // any bit pattern, including NaN, must survive unchanged
+    int bits[3] = {rand_r(&seed), rand_r(&seed), rand_r(&seed)};
+    float a;
+    double b;
+    memcpy(&a, bits, 4);
+    memcpy(&b, bits + 1, 8);
+    if (rand_r(&seed) & 1) {reinterpret_cast<whatA *>(buff)->populate(a, b, theString);}
+    else {reinterpret_cast<whatB *>(buff)->populate(bits[0], bits[1], theString);}
+}
+
+// true if two packets hold the same bytes and serialize alike
+bool samePacket(char *one, char *two)
+{
+    whatBase *p1 = reinterpret_cast<whatBase *>(one);
+    whatBase *p2 = reinterpret_cast<whatBase *>(two);
+    if (p1->getLength() != p2->getLength() || memcmp(one, two, p1->getLength())) {return false;}
+    ostringstream s1, s2;
+    p1->serialize(s1);
+    p2->serialize(s2);
+    return s1.str() == s2.str();
+}
+
+// true if packed output, with or without hex bytes, converts
+// back to exactly the Json that serialize() writes
+bool samePacked(char *one)
+{
+    whatBase *myWhat = reinterpret_cast<whatBase *>(one);
+    ostringstream json, packed, back;
+    myWhat->serialize(json);
+    packMode = true;
+    myWhat->serialize(packed);
+    packHex = !packHex;
+    myWhat->serialize(packed);
+    packHex = !packHex;
+    packMode = false;
+    istringstream is(packed.str());
+    return packToJson(is, back) && back.str() == json.str() + json.str();
+}
+
+// send random packets both ways through dictionary coding and the
+// send queue, every other one traced, compare with populate() and
+// modify() used directly, check trace records arrive unchanged, and
+// check packed output converts back, return count that differ
+long doSelfTest()
+{
+    static char ref[256], fast[256];
+    static whatDict outDict, inDict, backDict, replyDict;
+    unsigned seed = 1;
+    long mismatch = 0;
+    whatQueue queue;
+    FILE *file = tmpfile();
+    if (!file || !queue.init(4))
+    {
+        cerr << "Failed to set up self test." << endl;
+        return 1;
+    }
+
+    for (long n = 0; n < testCount; n++)
+    {
+        // reference packet, before and after modify
+        memset(ref, 0, sizeof(ref));
+        randomPacket(ref, seed);
+        whatBase *myRef = reinterpret_cast<whatBase *>(ref);
+        whatBase *myFast = reinterpret_cast<whatBase *>(fast);
+
+        // outbound, through queue and dictionary
+        whatTrace trace = {long(n), int(n & 1), 0, {0}}, back;
+        trace.delta[0] = seed;
+        queue.push(myRef, whatQueue::policyBlock, trace);
+        rewind(file);
+        bool fits = myRef->getLength() + sizeof(whatTrace) <= 256;    // or less once coded
+        queue.front()->writeOut(file, &outDict, queue.frontTrace());
+        queue.pop();
+        rewind(file);
+        memset(fast, 0, sizeof(fast));
+        if (myFast->readIn(file, &inDict, &back) == whatBase::typeNone || !samePacket(ref, fast)) {mismatch++;}
+        if (back.seq != trace.seq && (fits || back.seq)) {mismatch++;}
+        if (back.seq && (back.start != trace.start || back.delta[0] != trace.delta[0])) {mismatch++;}
+        if (!samePacked(ref)) {mismatch++;}
+
+        // inbound, after modify on both sides
+        myRef->modify();
+        myFast->modify();
+        rewind(file);
+        myFast->writeOut(file, &replyDict);
+        rewind(file);
+        memset(fast, 0, sizeof(fast));
+        if (myFast->readIn(file, &backDict) == whatBase::typeNone || !samePacket(ref, fast)) {mismatch++;}
+    }
+    fclose(file);
+    cerr << "{\"selfTest\":" << testCount << ",\"mismatch\":" << mismatch << '}' << endl;
+    return mismatch;
+}
+
+#ifdef PIPEY_FUZZ
+// fuzz entry point for libFuzzer, or AFL through its libFuzzer
+// driver.  Arbitrary bytes go through the packed stream converter
+// and the frame decoder, and each packet the decoder accepts is
+// modified and must survive a round trip.
+//   clang++ -g -DPIPEY_FUZZ -fsanitize=fuzzer,address,undefined pipey.cpp
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    static char pkt[256], back[256];
+    static whatDict inDict, outDict, backDict;
+    inDict.clear();
+    outDict.clear();
+    backDict.clear();
+    FILE *in = fmemopen(const_cast<unsigned char *>(data), size, "r");
+    FILE *out = tmpfile();
+    if (!in || !out) {if (in) {fclose(in);} if (out) {fclose(out);} return 0;}
+
+    // same bytes as a packed stream for the converter
+    ostringstream os;
+    istringstream is(string(reinterpret_cast<const char *>(data), size));
+    packToJson(is, os);
+    whatBase *myWhat = reinterpret_cast<whatBase *>(pkt);
+    whatBase *myBack = reinterpret_cast<whatBase *>(back);
+    memset(pkt, 0, sizeof(pkt));
+    while (myWhat->readIn(in, &inDict) != whatBase::typeNone)
+    {
+        myWhat->serialize(os);
+        myWhat->modify();
+        rewind(out);
+        myWhat->writeOut(out, &outDict);
+        rewind(out);
+        memset(back, 0, sizeof(back));
+        if (myBack->readIn(out, &backDict) == whatBase::typeNone
+            || myBack->getLength() != myWhat->getLength()
+            || memcmp(back, pkt, myWhat->getLength())) {abort();}
+        memset(pkt, 0, sizeof(pkt));
+    }
+    fclose(in);
+    fclose(out);
+    return 0;
+}
+
+#ifdef PIPEY_FUZZ_MAIN
+// replay one input from stdin, for AFL or a saved crash
+//   g++ -g -DPIPEY_FUZZ -DPIPEY_FUZZ_MAIN -fsanitize=address,undefined pipey.cpp
 int main()
 {
+    string data((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+    return LLVMFuzzerTestOneInput(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+}
+#endif
+#else
+// --------------------------------------------------------------
+// main entry point
+int main(int argc, char *argv[])
+{
+    mainStart = clockNs();
+
+    // parse command line options
+    static const struct option longOpts[] =
+    {
+        {"dict", no_argument, 0, 'd'},
+        {"window", required_argument, 0, 'w'},
+        {"queue", required_argument, 0, 'q'},
+        {"policy", required_argument, 0, 'p'},
+        {"count", required_argument, 0, 'n'},
+        {"huge", no_argument, 0, 'H'},
+        {"cpu", required_argument, 0, 'c'},
+        {"bench", no_argument, 0, 'b'},
+        {"selftest", required_argument, 0, 't'},
+        {"msgpack", no_argument, 0, 'm'},
+        {"hex", no_argument, 0, 'x'},
+        {"tojson", no_argument, 0, 'j'},
+        {"spin", required_argument, 0, 's'},
+        {"capture", required_argument, 0, 'C'},
+        {"replay", required_argument, 0, 'r'},
+        {"jobs", required_argument, 0, 'J'},
+        {"serve", required_argument, 0, 'S'},
+        {"workers", required_argument, 0, 'W'},
+        {"attach", required_argument, 0, 'A'},
+        {"schema", required_argument, 0, 'L'},
+        {"typebench", required_argument, 0, 'T'},
+        {"trace", required_argument, 0, 'P'},
+        {"trace-out", required_argument, 0, 'O'},
+        {0, 0, 0, 0}
+    };
+    static const char *policyNames[] = {"block", "oldest", "newest", "coalesce"};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "dw:q:p:n:Hc:bt:mxjs:C:r:J:S:W:A:L:T:P:O:", longOpts, 0)) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                useDict = true;
+                break;
+
+            case 'w':
+                window = atoi(optarg);
+                break;
+
+            case 'q':
+                budget = atoi(optarg);
+                break;
+
+            case 'p':
+                for (opt = 0; opt < 4 && strcmp(optarg, policyNames[opt]); opt++) {}
+                policy = whatQueue::policyEnum(opt);
+                if (opt < 4) {break;}
+                cerr << "Unknown policy: " << optarg << endl;
+                return -3;
+
+            case 'n':
+                sampleCount = atol(optarg);
+                break;
+
+            case 'H':
+                useHuge = true;
+                break;
+
+            case 'c':
+                pinCpu = atoi(optarg);
+                if (strchr(optarg, ',')) {childCpu = atoi(strchr(optarg, ',') + 1);}
+                break;
+
+            case 'b':
+                benchMode = true;
+                break;
+
+            case 't':
+                testCount = atol(optarg);
+                break;
+
+            case 'm':
+                packMode = true;
+                textOut = &cerr;
+                break;
+
+            case 'x':
+                packHex = true;
+                break;
+
+            case 'j':
+                toJson = true;
+                break;
+
+            case 's':
+                spinBudget = atol(optarg);
+                break;
+
+            case 'C':
+                captureFile = fopen(optarg, "w");
+                if (captureFile) {break;}
+                cerr << "Failed to open capture: " << optarg << endl;
+                return -3;
+
+            case 'r':
+                replayDir = optarg;
+                break;
+
+            case 'J':
+                replayJobs = atoi(optarg);
+                break;
+
+            case 'S':
+                servePath = optarg;
+                break;
+
+            case 'W':
+                serveWorkers = atoi(optarg);
+                break;
+
+            case 'A':
+                attachPath = optarg;
+                break;
+
+            case 'L':
+                if (loadSchema(optarg)) {break;}
+                return -3;
+
+            case 'T':
+                typeBench = atol(optarg);
+                break;
+
+            case 'P':
+                traceEvery = atol(optarg);
+                break;
+
+            case 'O':
+                traceOut = optarg;
+                break;
+
+            default:
+                cerr << "Usage: " << argv[0] << " [--dict] [--window 1-64] [--queue packets]"
+                    << "\n    [--policy block|oldest|newest|coalesce] [--count samples]"
+                    << "\n    [--huge] [--cpu n[,child]] [--spin us] [--bench] [--selftest packets]"
+                    << "\n    [--msgpack [--hex]] [--tojson] [--capture file]"
+                    << "\n    [--replay directory [--jobs n]]"
+                    << "\n    [--serve socket [--workers n]] [--attach socket]"
+                    << "\n    [--schema file] [--typebench packets]"
+                    << "\n    [--trace every [--trace-out file]]" << endl;
+                return -3;
+        }
+    }
+
+    // window of 64 packets stays well inside the pipe capacity
+    if (window < 1 || window > 64 || budget < 1 || sampleCount < 0
+        || spinBudget < 0 || traceEvery < 0 || (benchMode && !sampleCount))
+    {
+        cerr << "Bad window: " << window << ", queue: " << budget << ", count: "
+            << sampleCount << ", spin: " << spinBudget << ", or trace: " << traceEvery
+            << ", bench needs count" << endl;
+        return -3;
+    }
+
+    // converter runs without a child
+    if (toJson)
+    {
+        if (packToJson(cin, cout)) {return 0;}
+        cerr << "Bad packed input." << endl;
+        return -4;
+    }
+
+    // replay runs without a child
+    if (replayDir) {return doReplay();}
+
     // check struct packing
-    cout << "Type A is 20 bytes without string: " << sizeof(whatA)
+    *textOut << "Type A is 20 bytes without string: " << sizeof(whatA)
         << "\nType B is 14 bytes without string: " << sizeof(whatB) << endl;
 
+    // differential test and type bench run without a child
+    if (testCount > 0) {return doSelfTest()? -4: 0;}
+    if (typeBench > 0) {return doTypeBench(typeBench);}
+
+    // pin before any buffer is touched, child inherits this, a
+    // service pins each worker instead
+    if (pinCpu >= 0 && !servePath && !pinTo(pinCpu)) {return -3;}
+
+    // service and its clients need no pipes
+    if (servePath) {return doServe();}
+    if (attachPath)
+    {
+        int fd = attachTo(attachPath);
+        if (fd < 0)
+        {
+            cerr << "Failed to attach to: " << attachPath << endl;
+            return -5;
+        }
+        pid = getpid();
+        doParentStuff(fd, dup(fd));
+        return 0;
+    }
+
     // open two anonymous pipes
     if (pipe(firstPipe))
     {
@@ -349,12 +2725,26 @@ int main()
 
     // fork into two processes
     pid = fork();
-    if (!pid) {doChildStuff();}
+    if (!pid)
+    {
+        // child runs where asked, or next to the parent and its buffers
+        if (childCpu >= 0) {pinTo(childCpu);}
+        else if (pinCpu >= 0) {pinTo(nearCpu(pinCpu));}
+        close(firstPipe[1]);
+        close(secondPipe[0]);
+        doChildStuff(firstPipe[0], secondPipe[1]);
+    }
     else if (pid < 0)
     {
         cerr << "Fork failed: " << pid << endl;
         return -2;
     }
-    else {doParentStuff();}
+    else
+    {
+        close(firstPipe[0]);
+        close(secondPipe[1]);
+        doParentStuff(secondPipe[0], firstPipe[1]);
+    }
     return 0;
 }
+#endif